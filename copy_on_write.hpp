@@ -1,11 +1,26 @@
 #ifndef COPY_ON_WRITE_HPP
 #define COPY_ON_WRITE_HPP
 
+#include <algorithm>
 #include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <limits>
 #include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
 
-template <typename T>
-class CopyOnWrite {
+#if defined(__GNUC__) || defined(__clang__)
+#define COPY_ON_WRITE_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define COPY_ON_WRITE_NOINLINE __declspec(noinline)
+#else
+#define COPY_ON_WRITE_NOINLINE
+#endif
+
+class CopyOnWriteCore {
 
 	// Eplanation:
 	// Read behaves like a shared pointer with a bit less functionality, but it can't be simply copied out of the structure,
@@ -16,40 +31,55 @@ class CopyOnWrite {
 	// incrementing the refcount and decreased back immediately afterwards. In case an overwrite happens, this counter
 	// is copied into an extra counter where the threads decrement it if they find an overwrite took place. The overwriter
 	// does not decrement the refcount and keeps it alive until the threads reduce this counter to zero.
+	//
+	// None of this depends on the type of the contents, so it's kept out of the template and works with a control block
+	// that knows how to destroy the object it's part of. This way, the code exists only once in the binary no matter
+	// how many types are used in CopyOnWrite. It's not inlined so that the compiler doesn't copy it into every caller.
 
-	struct Internal {
+protected:
+	struct ControlBlock {
 		mutable std::atomic_size_t refcount = 1;
-		T instance;
-
-		template <typename... Args>
-		Internal(Args&&... args) : instance(std::move(args)...) {}
+		void (*destroy)(const ControlBlock*) noexcept = nullptr; // Deletes the whole object the control block is part of
 	};
 
+private:
 	mutable std::atomic_uint64_t addressAndCopyCounter = 0; // The 48 used bits of a 64 bit pointer plus number of dereferencers
 	mutable std::atomic_int previousCopyCounter = 0; // Dereferencers left hit by overwrite (negative values are valid)
-	mutable std::mutex editMutex = {}; // Editing uses a traditional lock
 
 	constexpr static uint64_t increment = 0x0001000000000000;
 	constexpr static uint64_t prefix = 0xffff000000000000;
 	constexpr static uint64_t suffix = 0x0000ffffffffffff;
 
-	static Internal* getPointer(uint64_t value) noexcept {
+	static ControlBlock* getPointer(uint64_t value) noexcept {
 		if (value & 0x0000800000000000) {
 			value |= prefix;
 		} else {
 			value &= suffix;
 		}
-		return reinterpret_cast<Internal*>(value);
+		return reinterpret_cast<ControlBlock*>(value);
+	}
+
+protected:
+	mutable std::mutex editMutex = {}; // Editing uses a traditional lock
+
+	explicit CopyOnWriteCore(ControlBlock* initial) noexcept {
+		addressAndCopyCounter.store(reinterpret_cast<uint64_t>(initial));
+	}
+
+	COPY_ON_WRITE_NOINLINE ~CopyOnWriteCore() {
+		ControlBlock* lastReferenced = safeInstance();
+		getRidOfPointer(lastReferenced);
+		getRidOfPointer(lastReferenced);
 	}
 
-	static void getRidOfPointer(const Internal* pointer) noexcept {
+	COPY_ON_WRITE_NOINLINE static void getRidOfPointer(const ControlBlock* pointer) noexcept {
 		size_t refcountLeft = --pointer->refcount;
 		if (refcountLeft == 0) {
-			delete pointer;
+			pointer->destroy(pointer);
 		}
 	}
 
-	Internal* safeInstance() const noexcept {
+	COPY_ON_WRITE_NOINLINE ControlBlock* safeInstance() const noexcept {
 		// Increment the pointer's counter
 		uint64_t value = addressAndCopyCounter.load();
 		uint64_t newValue = 0;
@@ -58,7 +88,7 @@ class CopyOnWrite {
 		} while (!addressAndCopyCounter.compare_exchange_weak(value, newValue));
 
 		// Increment the object's refcount
-		Internal* obtained = getPointer(value);
+		ControlBlock* obtained = getPointer(value);
 		obtained->refcount++;
 
 		// Decrement the pointer's counter
@@ -75,11 +105,268 @@ class CopyOnWrite {
 		return obtained;
 	}
 
+	ControlBlock* currentInstance() const noexcept {
+		// Can be called only with the mutex locked!!!
+		return getPointer(addressAndCopyCounter);
+	}
+
+	COPY_ON_WRITE_NOINLINE void publish(ControlBlock* replacement) noexcept {
+		// Can be called only with the mutex locked!!!
+
+		ControlBlock* original = currentInstance();
+		uint64_t oldValue = addressAndCopyCounter.exchange(reinterpret_cast<uint64_t>(replacement)); // Expose a new version
+
+		uint64_t abandoned = oldValue >> 48;
+		previousCopyCounter += abandoned;
+		do {} while (previousCopyCounter.load() != 0); // Busy wait until all accesses to the old pointer are finished
+		getRidOfPointer(original);
+	}
+};
+
+class CopyOnWriteArena {
+
+	// Explanation:
+	// Readers often build temporary structures derived from a version they're reading. Allocating them here is only
+	// a pointer bump and they are all freed at once together with the version, so nothing is freed individually.
+	// Allocation is done by a compare and swap on the used part of the current block, only creating a new block
+	// is done under a lock. Blocks are allocated lazily, so versions nobody allocated from don't take any memory.
+	// Destructors of the allocated objects are never called by the arena.
+
+	struct Block {
+		Block* previous = nullptr;
+		size_t capacity = 0;
+		std::atomic_size_t used = 0;
+
+		char* data() noexcept {
+			return reinterpret_cast<char*>(this + 1);
+		}
+	};
+
+	std::atomic<Block*> current = nullptr;
+	std::mutex growMutex = {};
+	const size_t blockSize = 0;
+
+	static void* tryAllocate(Block* block, size_t size, size_t alignment) noexcept {
+		uintptr_t start = reinterpret_cast<uintptr_t>(block->data());
+		size_t used = block->used.load();
+		size_t offset = 0;
+		do {
+			offset = ((start + used + alignment - 1) & ~uintptr_t(alignment - 1)) - start;
+			if (offset + size > block->capacity) {
+				return nullptr;
+			}
+		} while (!block->used.compare_exchange_weak(used, offset + size));
+		return block->data() + offset;
+	}
+
+public:
+	explicit CopyOnWriteArena(size_t blockSize) : blockSize(blockSize) {}
+	CopyOnWriteArena(const CopyOnWriteArena&) = delete;
+	CopyOnWriteArena& operator=(const CopyOnWriteArena&) = delete;
+
+	~CopyOnWriteArena() {
+		Block* block = current.load();
+		while (block) {
+			Block* previous = block->previous;
+			block->~Block();
+			::operator delete(block);
+			block = previous;
+		}
+	}
+
+	void* allocate(size_t size, size_t alignment = alignof(std::max_align_t)) {
+		Block* block = current.load();
+		while (true) {
+			if (block) {
+				if (void* allocated = tryAllocate(block, size, alignment)) {
+					return allocated;
+				}
+			}
+
+			std::lock_guard lock(growMutex);
+			if (current.load() == block) { // Otherwise someone else added a block in the meantime
+				size_t capacity = std::max(blockSize, size + alignment);
+				Block* added = new (::operator new(sizeof(Block) + capacity)) Block();
+				added->previous = block;
+				added->capacity = capacity;
+				current.store(added);
+			}
+			block = current.load();
+		}
+	}
+
+	template <typename U, typename... Args>
+	U* make(Args&&... args) {
+		static_assert(std::is_trivially_destructible_v<U>, "Destructors of objects in CopyOnWriteArena are never called");
+		return new (allocate(sizeof(U), alignof(U))) U(std::forward<Args>(args)...);
+	}
+
+	// Allocator for standard containers, memory is returned only when the arena is destroyed
+	template <typename U>
+	class Allocator {
+		CopyOnWriteArena* arena = nullptr;
+
+		template <typename Other>
+		friend class Allocator;
+
+	public:
+		using value_type = U;
+
+		Allocator(CopyOnWriteArena& arena) noexcept : arena(&arena) {}
+		template <typename Other>
+		Allocator(const Allocator<Other>& other) noexcept : arena(other.arena) {}
+
+		U* allocate(size_t count) {
+			return static_cast<U*>(arena->allocate(count * sizeof(U), alignof(U)));
+		}
+		void deallocate(U*, size_t) noexcept {}
+
+		template <typename Other>
+		bool operator==(const Allocator<Other>& other) const noexcept {
+			return arena == other.arena;
+		}
+		template <typename Other>
+		bool operator!=(const Allocator<Other>& other) const noexcept {
+			return arena != other.arena;
+		}
+	};
+};
+
+class CopyOnWriteReclaimer {
+
+	// Explanation:
+	// Destroying a huge object in one go holds the allocator's locks for a long time and returns lots of pages at once,
+	// which slows down all other threads. Versions of types with incremental destruction are therefore not deleted
+	// when their last reference disappears, but queued here and destroyed in slices whenever reclaim() is called,
+	// typically periodically from a background thread. The size of the slices is up to the type, it may mean nodes,
+	// bytes or anything else.
+
+public:
+	using DestroySome = size_t (*)(const void* object, size_t budget) noexcept; // Returns less than budget once done
+
+private:
+	struct Retired {
+		const void* object = nullptr;
+		DestroySome destroySome = nullptr;
+	};
+
+	std::deque<Retired> retired = {};
+	mutable std::mutex retiredMutex = {};
+
+	CopyOnWriteReclaimer() = default;
+
+public:
+	CopyOnWriteReclaimer(const CopyOnWriteReclaimer&) = delete;
+	CopyOnWriteReclaimer& operator=(const CopyOnWriteReclaimer&) = delete;
+
+	static CopyOnWriteReclaimer& instance() {
+		// Never destroyed, versions may be released during destruction of static objects
+		static CopyOnWriteReclaimer* reclaimer = new CopyOnWriteReclaimer();
+		return *reclaimer;
+	}
+
+	void retire(const void* object, DestroySome destroySome) noexcept {
+		try {
+			std::lock_guard lock(retiredMutex);
+			retired.push_back(Retired{object, destroySome});
+		} catch (...) {
+			destroySome(object, std::numeric_limits<size_t>::max()); // Can't queue it, so it's better to destroy it now
+		}
+	}
+
+	// Destroys at most about budget of queued versions, returns how much was actually destroyed
+	size_t reclaim(size_t budget) {
+		size_t spent = 0;
+		while (spent < budget) {
+			Retired processed = {};
+			{
+				std::lock_guard lock(retiredMutex);
+				if (retired.empty()) {
+					break;
+				}
+				processed = retired.front();
+				retired.pop_front();
+			}
+
+			size_t available = budget - spent;
+			size_t destroyed = processed.destroySome(processed.object, available);
+			spent += std::min(destroyed, available);
+			if (destroyed >= available) { // Not finished yet, continue with it next time
+				std::lock_guard lock(retiredMutex);
+				retired.push_front(processed);
+			}
+		}
+		return spent;
+	}
+
+	void reclaimAll() {
+		while (pending() > 0) {
+			reclaim(std::numeric_limits<size_t>::max());
+		}
+	}
+
+	size_t pending() const {
+		std::lock_guard lock(retiredMutex);
+		return retired.size();
+	}
+};
+
+struct CopyOnWriteDefaultTraits {
+	// If not zero, every version carries a CopyOnWriteArena allocating blocks of this size, accessible from readers
+	constexpr static size_t arenaBlockSize = 0;
+
+	// If true, old versions are destroyed in slices by CopyOnWriteReclaimer rather than deleted when no longer used,
+	// the traits must then have a static size_t destroySome(T&, size_t budget) that tears down at most budget of it
+	// and returns how much it tore down, which must be less than budget once there's nothing left
+	constexpr static bool incrementalDestroy = false;
+};
+
+template <typename T, typename Traits = CopyOnWriteDefaultTraits>
+class CopyOnWrite : private CopyOnWriteCore {
+
+	// Only construction, copying and destruction of the contents are specific to the type, the rest is in CopyOnWriteCore
+
+	struct NoArena {
+		explicit NoArena(size_t) {}
+	};
+	constexpr static bool hasArena = (Traits::arenaBlockSize > 0);
+	using Arena = std::conditional_t<hasArena, CopyOnWriteArena, NoArena>;
+
+	struct Internal : ControlBlock, Arena {
+		T instance;
+
+		template <typename... Args>
+		Internal(Args&&... args) : Arena(Traits::arenaBlockSize), instance(std::move(args)...) {
+			destroy = &destroyInternal;
+		}
+
+		static void destroyInternal(const ControlBlock* pointer) noexcept {
+			if constexpr (Traits::incrementalDestroy) {
+				CopyOnWriteReclaimer::instance().retire(static_cast<const Internal*>(pointer), &destroySlice);
+			} else {
+				delete static_cast<const Internal*>(pointer);
+			}
+		}
+
+		static size_t destroySlice(const void* pointer, size_t budget) noexcept {
+			Internal* destroyed = const_cast<Internal*>(static_cast<const Internal*>(pointer));
+			size_t spent = Traits::destroySome(destroyed->instance, budget);
+			if (spent < budget) {
+				delete destroyed;
+			}
+			return spent;
+		}
+	};
+
+	Internal* safeInstance() const noexcept {
+		return static_cast<Internal*>(CopyOnWriteCore::safeInstance());
+	}
+
 	template <typename Creator, typename Verifier>
 	bool replace(const Creator& creator, const Verifier& verifier) {
 		// Can be called only with the mutex locked!!!
 
-		Internal* original = getPointer(addressAndCopyCounter);
+		Internal* original = static_cast<Internal*>(currentInstance());
 		if (!verifier(std::as_const(original->instance))) {
 			return false; // Turned out we didn't need to modify
 		}
@@ -94,13 +381,7 @@ class CopyOnWrite {
 			return false;
 		}
 
-		uint64_t oldValue = addressAndCopyCounter.exchange(reinterpret_cast<uint64_t>(replacement)); // Expose a new version
-
-		uint64_t abandoned = oldValue >> 48;
-		previousCopyCounter += abandoned;
-		do {} while (previousCopyCounter.load() != 0); // Busy wait until all accesses to the old pointer are finished
-		getRidOfPointer(original);
-
+		publish(replacement);
 		return true; // Did modify
 	}
 
@@ -141,15 +422,8 @@ class CopyOnWrite {
 
 public:
 	template <typename... Args>
-	CopyOnWrite(Args&&... args) {
+	CopyOnWrite(Args&&... args) : CopyOnWriteCore(new Internal(std::move(args)...)) {
 		static_assert(std::is_constructible_v<T, Args...>, "Object inside CopyOnWrite can't be constructed from the arguments");
-		addressAndCopyCounter.store(reinterpret_cast<uint64_t>(new Internal(std::move(args)...)));
-	}
-
-	~CopyOnWrite() {
-		Internal* lastReferenced = safeInstance();
-		getRidOfPointer(lastReferenced);
-		getRidOfPointer(lastReferenced);
 	}
 
 	class CopyOnWriteStateReference {
@@ -195,6 +469,15 @@ public:
 		const T* operator->() const {
 			return &instance->instance;
 		}
+		const T& operator*() const {
+			return instance->instance;
+		}
+
+		// Memory allocated from it lives as long as this version
+		CopyOnWriteArena& arena() const {
+			static_assert(hasArena, "CopyOnWrite needs Traits with nonzero arenaBlockSize to have an arena");
+			return const_cast<Internal&>(*instance);
+		}
 	};
 
 	CopyOnWriteStateReference get() const {
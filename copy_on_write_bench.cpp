@@ -0,0 +1,60 @@
+//usr/bin/g++ --std=c++17 -Wall -O2 $0 -o ${o=`mktemp`} && exec $o $*
+// Measures the cost of having many CopyOnWrite instantiations in one binary. It prints the size of the executable
+// and the time of reads and edits cycling through all the instantiations, which is dominated by instruction cache
+// misses if each instantiation has its own copy of the code. To count the misses directly, compile it and run:
+//   perf stat -e L1-icache-load-misses,instructions ./binary
+// The size of the code alone can be checked with `size ./binary`.
+#include "copy_on_write.hpp"
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <tuple>
+#include <utility>
+
+template <int N>
+struct Payload {
+	int value = N;
+};
+
+template <int... Ns>
+std::tuple<CopyOnWrite<Payload<Ns>>...> makeInstances(std::integer_sequence<int, Ns...>);
+
+constexpr int instantiations = 150;
+using Instances = decltype(makeInstances(std::make_integer_sequence<int, instantiations>()));
+
+int main(int, char** argv)
+{
+	constexpr int rounds = 20000;
+	constexpr int editEvery = 16;
+	Instances instances;
+
+	std::error_code error;
+	auto binarySize = std::filesystem::file_size("/proc/self/exe", error);
+	if (error) {
+		binarySize = std::filesystem::file_size(argv[0], error);
+	}
+
+	long long checksum = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int round = 0; round < rounds; round++) {
+		std::apply([&] (auto&... each) {
+			((checksum += each->value), ...);
+		}, instances);
+		if (round % editEvery == 0) {
+			std::apply([&] (auto&... each) {
+				(each.edit([] (auto& edited) {
+					edited.value++;
+				}), ...);
+			}, instances);
+		}
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	double operations = double(rounds) * instantiations * (1 + 1.0 / editEvery);
+	double nanoseconds = std::chrono::duration<double, std::nano>(end - start).count();
+	std::cout << "Instantiations: " << instantiations << std::endl;
+	std::cout << "Binary size: " << binarySize << " bytes" << std::endl;
+	std::cout << "Time per operation: " << (nanoseconds / operations) << " ns" << std::endl;
+	std::cout << "Checksum: " << checksum << std::endl;
+	return 0;
+}
@@ -1,6 +1,9 @@
 //usr/bin/g++ --std=c++17 -Wall $0 -g -o ${o=`mktemp`} && exec $o $*
 #include "copy_on_write.hpp"
+#include "persistent_rope.hpp"
 #include <iostream>
+#include <memory>
+#include <string>
 #include <thread>
 #include <vector>
 
@@ -11,6 +14,36 @@ struct TestClass {
 	TestClass(int a) : a(a) {}
 };
 
+struct HugeClass {
+	static inline int destroyed = 0;
+	std::vector<std::unique_ptr<int>> nodes;
+
+	HugeClass(int count) {
+		for (int i = 0; i < count; i++) {
+			nodes.push_back(std::make_unique<int>(i));
+		}
+	}
+	~HugeClass() {
+		destroyed++;
+	}
+};
+
+struct IncrementalTraits : CopyOnWriteDefaultTraits {
+	constexpr static bool incrementalDestroy = true;
+	static size_t destroySome(HugeClass& destroyed, size_t budget) noexcept {
+		size_t spent = 0;
+		while (spent < budget && !destroyed.nodes.empty()) {
+			destroyed.nodes.pop_back();
+			spent++;
+		}
+		return spent;
+	}
+};
+
+struct ArenaTraits : CopyOnWriteDefaultTraits {
+	constexpr static size_t arenaBlockSize = 256;
+};
+
 int main()
 {
 	int errors = 0;
@@ -157,6 +190,127 @@ int main()
 		}
 	}
 
+	{
+		std::string text(20000, ' ');
+		for (size_t i = 0; i < text.size(); i++) {
+			text[i] = 'a' + (i * 7) % 26;
+		}
+		CopyOnWrite<PersistentRope> tested(text);
+		CopyOnWrite<PersistentRope>::CopyOnWriteStateReference original = tested.get();
+		doATest(tested->size(), text.size());
+		doATest(tested->toString() == text, true);
+		doATest(tested.edit([] (PersistentRope& edited) {
+			edited.insert(5000, "inserted");
+			edited.erase(100, 50);
+			edited.splice(0, 3, "XY");
+		}), true);
+		text.insert(5000, "inserted");
+		text.erase(100, 50);
+		text.replace(0, 3, "XY");
+		doATest(tested->toString() == text, true);
+		doATest(original->size(), size_t(20000));
+		doATest(original->at(100), 'a' + (100 * 7) % 26);
+		doATest(tested->substr(4949, 8).toString(), std::string("inserted"));
+
+		size_t chunkCount = 0;
+		size_t totalLength = 0;
+		auto snapshot = tested.get();
+		for (std::string_view chunk : snapshot->chunks()) {
+			chunkCount++;
+			totalLength += chunk.size();
+		}
+		doATest(chunkCount > 1, true);
+		doATest(totalLength, text.size());
+
+		PersistentRope rope;
+		std::string expected;
+		for (int i = 0; i < 5000; i++) {
+			size_t position = (i * 7919) % (expected.size() + 1);
+			std::string inserted = std::to_string(i);
+			rope.insert(position, inserted);
+			expected.insert(position, inserted);
+			if (i % 3 == 0) {
+				size_t erased = (i * 104729) % expected.size();
+				rope.erase(erased, 2);
+				expected.erase(erased, 2);
+			}
+		}
+		doATest(rope.toString() == expected, true);
+		doATest(rope.depth() < 30, true);
+	}
+
+	{
+		CopyOnWrite<std::vector<int>, ArenaTraits> tested(std::vector<int>{1, 2, 3, 4, 5, 6});
+		auto snapshot = tested.get();
+		std::vector<int, CopyOnWriteArena::Allocator<int>> filtered(snapshot.arena());
+		for (int it : *snapshot) {
+			if (it % 2 == 0) {
+				filtered.push_back(it);
+			}
+		}
+		doATest(filtered.size(), size_t(3));
+		doATest(filtered[2], 6);
+		double* aligned = snapshot.arena().make<double>(2.5);
+		doATest(reinterpret_cast<uintptr_t>(aligned) % alignof(double), uintptr_t(0));
+		doATest(*aligned, 2.5);
+		void* large = snapshot.arena().allocate(1000);
+		doATest(large != nullptr, true);
+		doATest(&tested.get().arena() == &snapshot.arena(), true);
+		doATest(tested.edit([] (std::vector<int>& edited) {
+			edited.push_back(7);
+		}), true);
+		doATest(&tested.get().arena() != &snapshot.arena(), true);
+
+		constexpr int threadCount = 4;
+		std::vector<std::thread> allocators = {};
+		std::vector<int*> allocated(threadCount * 1000);
+		for (int i = 0; i < threadCount; i++) {
+			allocators.push_back(std::thread([&, i] () {
+				for (int j = 0; j < 1000; j++) {
+					allocated[i * 1000 + j] = snapshot.arena().make<int>(i * 1000 + j);
+				}
+			}));
+		}
+		for (std::thread& it : allocators) {
+			it.join();
+		}
+		bool overlapFound = false;
+		for (int i = 0; i < threadCount * 1000; i++) {
+			if (*allocated[i] != i) {
+				overlapFound = true;
+			}
+		}
+		doATest(overlapFound, false);
+	}
+
+	{
+		CopyOnWriteReclaimer& reclaimer = CopyOnWriteReclaimer::instance();
+		{
+			CopyOnWrite<HugeClass, IncrementalTraits> tested(25);
+			doATest(tested.emplace(3), true);
+			doATest(HugeClass::destroyed, 0);
+			doATest(reclaimer.pending(), size_t(1));
+			doATest(reclaimer.reclaim(10), size_t(10));
+			doATest(reclaimer.reclaim(10), size_t(10));
+			doATest(HugeClass::destroyed, 0);
+			doATest(reclaimer.reclaim(10), size_t(5));
+			doATest(HugeClass::destroyed, 1);
+			doATest(reclaimer.pending(), size_t(0));
+
+			auto reference = tested.get();
+			doATest(tested.emplace(4), true);
+			doATest(reclaimer.pending(), size_t(0));
+			reference = tested.get();
+			doATest(reclaimer.pending(), size_t(1));
+		}
+		doATest(reclaimer.pending(), size_t(2));
+		doATest(reclaimer.reclaim(5), size_t(5));
+		doATest(HugeClass::destroyed, 2);
+		reclaimer.reclaimAll();
+		doATest(HugeClass::destroyed, 3);
+		doATest(reclaimer.pending(), size_t(0));
+	}
+
 	std::cout << "Passed: " << (tests - errors) << " / " << tests << ", errors: " << errors << std::endl;
 	return 0;
 }
@@ -0,0 +1,306 @@
+#ifndef PERSISTENT_ROPE_HPP
+#define PERSISTENT_ROPE_HPP
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class PersistentRope {
+
+	// Explanation:
+	// The text is kept in a height-balanced binary tree whose leaves are slices of immutable character buffers.
+	// Nodes are never modified after creation, so a modification only creates the O(log n) nodes on the path it changes
+	// and shares everything else with the previous version. This makes copying a rope a single reference count increment,
+	// which is what CopyOnWrite does on every edit, and it's safe to read old versions from other threads.
+	//
+	// Everything is built from two operations, join and split. Join concatenates two balanced trees by descending along
+	// the spine of the taller one and rotating on the way back up, split cuts a tree at a position and joins the pieces
+	// left and right of the path. Both are O(log n). Splitting a leaf doesn't copy anything, it only creates two slices
+	// of the same buffer. Tiny adjacent leaves are merged when joined so that many small edits don't fragment the tree.
+
+	struct Node {
+		std::shared_ptr<const Node> left = nullptr;
+		std::shared_ptr<const Node> right = nullptr;
+		std::shared_ptr<const char[]> buffer = nullptr; // Only in leaves
+		const char* data = nullptr; // Only in leaves, points into buffer
+		size_t length = 0;
+		int height = 0; // Leaves have height 0
+
+		bool isLeaf() const {
+			return !left;
+		}
+		std::string_view text() const {
+			return std::string_view(data, length);
+		}
+	};
+	using NodePointer = std::shared_ptr<const Node>;
+
+	NodePointer root = nullptr;
+
+	static int heightOf(const NodePointer& node) {
+		return node ? node->height : -1;
+	}
+
+	static NodePointer makeLeaf(std::string_view text) {
+		std::shared_ptr<char[]> buffer(new char[text.size()]);
+		std::memcpy(buffer.get(), text.data(), text.size());
+		auto made = std::make_shared<Node>();
+		made->data = buffer.get();
+		made->buffer = std::move(buffer);
+		made->length = text.size();
+		return made;
+	}
+
+	static NodePointer makeSlice(const NodePointer& leaf, size_t start, size_t length) {
+		if (start == 0 && length == leaf->length) {
+			return leaf;
+		}
+		auto made = std::make_shared<Node>();
+		made->buffer = leaf->buffer;
+		made->data = leaf->data + start;
+		made->length = length;
+		return made;
+	}
+
+	static NodePointer makeInner(NodePointer left, NodePointer right) {
+		auto made = std::make_shared<Node>();
+		made->length = left->length + right->length;
+		made->height = std::max(left->height, right->height) + 1;
+		made->left = std::move(left);
+		made->right = std::move(right);
+		return made;
+	}
+
+	static NodePointer rotateLeft(const NodePointer& node) {
+		return makeInner(makeInner(node->left, node->right->left), node->right->right);
+	}
+
+	static NodePointer rotateRight(const NodePointer& node) {
+		return makeInner(node->left->left, makeInner(node->left->right, node->right));
+	}
+
+	// Creates an inner node and fixes a height difference of 2 between the children
+	static NodePointer balance(NodePointer left, NodePointer right) {
+		if (left->height > right->height + 1) {
+			if (heightOf(left->right) > heightOf(left->left)) {
+				left = rotateLeft(left);
+			}
+			return rotateRight(makeInner(std::move(left), std::move(right)));
+		}
+		if (right->height > left->height + 1) {
+			if (heightOf(right->left) > heightOf(right->right)) {
+				right = rotateRight(right);
+			}
+			return rotateLeft(makeInner(std::move(left), std::move(right)));
+		}
+		return makeInner(std::move(left), std::move(right));
+	}
+
+	static NodePointer join(const NodePointer& left, const NodePointer& right) {
+		if (!left || left->length == 0) {
+			return right;
+		}
+		if (!right || right->length == 0) {
+			return left;
+		}
+		if (left->isLeaf() && right->isLeaf() && left->length + right->length <= mergeLimit) {
+			std::string merged;
+			merged.reserve(left->length + right->length);
+			merged.append(left->text()).append(right->text());
+			return makeLeaf(merged);
+		}
+		if (left->height > right->height + 1) {
+			return balance(left->left, join(left->right, right));
+		}
+		if (right->height > left->height + 1) {
+			return balance(join(left, right->left), right->right);
+		}
+		return makeInner(left, right);
+	}
+
+	static std::pair<NodePointer, NodePointer> split(const NodePointer& node, size_t position) {
+		if (!node) {
+			return {nullptr, nullptr};
+		}
+		if (position == 0) {
+			return {nullptr, node};
+		}
+		if (position >= node->length) {
+			return {node, nullptr};
+		}
+		if (node->isLeaf()) {
+			return {makeSlice(node, 0, position), makeSlice(node, position, node->length - position)};
+		}
+		if (position < node->left->length) {
+			auto [first, second] = split(node->left, position);
+			return {std::move(first), join(second, node->right)};
+		}
+		auto [first, second] = split(node->right, position - node->left->length);
+		return {join(node->left, first), std::move(second)};
+	}
+
+	static NodePointer build(std::string_view text) {
+		if (text.empty()) {
+			return nullptr;
+		}
+		if (text.size() <= chunkSize) {
+			return makeLeaf(text);
+		}
+		// Split in the middle of a chunk boundary so that both halves have about the same height
+		size_t chunks = (text.size() + chunkSize - 1) / chunkSize;
+		size_t half = (chunks / 2) * chunkSize;
+		return makeInner(build(text.substr(0, half)), build(text.substr(half)));
+	}
+
+	explicit PersistentRope(NodePointer root) : root(std::move(root)) {}
+
+public:
+	constexpr static size_t chunkSize = 4096; // Size of chunks a rope constructed from a string is split into
+	constexpr static size_t mergeLimit = 256; // Adjacent leaves smaller than this together are merged when joined
+
+	PersistentRope() = default;
+	PersistentRope(std::string_view text) : root(build(text)) {}
+	PersistentRope(const std::string& text) : root(build(text)) {}
+	PersistentRope(const char* text) : root(build(text)) {}
+
+	size_t size() const {
+		return root ? root->length : 0;
+	}
+
+	bool empty() const {
+		return size() == 0;
+	}
+
+	char operator[](size_t position) const {
+		const Node* node = root.get();
+		while (!node->isLeaf()) {
+			if (position < node->left->length) {
+				node = node->left.get();
+			} else {
+				position -= node->left->length;
+				node = node->right.get();
+			}
+		}
+		return node->data[position];
+	}
+
+	char at(size_t position) const {
+		if (position >= size()) {
+			throw std::out_of_range("Position outside of PersistentRope");
+		}
+		return (*this)[position];
+	}
+
+	PersistentRope substr(size_t position, size_t length = std::string::npos) const {
+		if (position > size()) {
+			throw std::out_of_range("Position outside of PersistentRope");
+		}
+		length = std::min(length, size() - position);
+		NodePointer after = split(root, position).second;
+		return PersistentRope(split(after, length).first);
+	}
+
+	void insert(size_t position, const PersistentRope& inserted) {
+		if (position > size()) {
+			throw std::out_of_range("Position outside of PersistentRope");
+		}
+		auto [first, second] = split(root, position);
+		root = join(join(first, inserted.root), second);
+	}
+
+	void append(const PersistentRope& appended) {
+		root = join(root, appended.root);
+	}
+
+	void erase(size_t position, size_t length = std::string::npos) {
+		if (position > size()) {
+			throw std::out_of_range("Position outside of PersistentRope");
+		}
+		length = std::min(length, size() - position);
+		auto [first, rest] = split(root, position);
+		root = join(first, split(rest, length).second);
+	}
+
+	// Replaces a range of the text by another rope, sharing its structure
+	void splice(size_t position, size_t length, const PersistentRope& replacement) {
+		if (position > size()) {
+			throw std::out_of_range("Position outside of PersistentRope");
+		}
+		length = std::min(length, size() - position);
+		auto [first, rest] = split(root, position);
+		root = join(join(first, replacement.root), split(rest, length).second);
+	}
+
+	// Iterates over the contiguous pieces of the text in order, without copying them
+	class ChunkIterator {
+		std::vector<const Node*> path = {}; // Nodes whose right subtree is yet to be visited, current leaf on top
+
+		void descend(const Node* node) {
+			while (node) {
+				path.push_back(node);
+				node = node->isLeaf() ? nullptr : node->left.get();
+			}
+		}
+
+	public:
+		ChunkIterator() = default;
+		explicit ChunkIterator(const Node* root) {
+			descend(root);
+		}
+
+		std::string_view operator*() const {
+			return path.back()->text();
+		}
+
+		ChunkIterator& operator++() {
+			path.pop_back();
+			if (!path.empty()) {
+				const Node* parent = path.back();
+				path.pop_back();
+				descend(parent->right.get());
+			}
+			return *this;
+		}
+
+		bool operator==(const ChunkIterator& other) const {
+			return path.empty() ? other.path.empty() : (!other.path.empty() && path.back() == other.path.back());
+		}
+		bool operator!=(const ChunkIterator& other) const {
+			return !(*this == other);
+		}
+	};
+
+	struct Chunks {
+		const Node* root = nullptr;
+		ChunkIterator begin() const {
+			return ChunkIterator(root);
+		}
+		ChunkIterator end() const {
+			return ChunkIterator();
+		}
+	};
+
+	// The returned object refers to this rope's nodes, copy the rope first if it may change during iteration
+	Chunks chunks() const {
+		return Chunks{root.get()};
+	}
+
+	std::string toString() const {
+		std::string made;
+		made.reserve(size());
+		for (std::string_view chunk : chunks()) {
+			made.append(chunk);
+		}
+		return made;
+	}
+
+	int depth() const {
+		return heightOf(root) + 1;
+	}
+};
+
+#endif // PERSISTENT_ROPE_HPP